@@ -0,0 +1,24 @@
+#include "common.h"
+
+double apply(char op, double a, double b) {
+	switch (op) {
+	case '+':
+		return a + b;
+	case '-':
+		return a - b;
+	case '*':
+		return a * b;
+	case '/':
+		return b != 0 ? a / b : 0;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 4) {
+		fprintf(stderr, "usage: calc a op b\n");
+		return 1;
+	}
+	printf("%f\n", apply(argv[2][0], atof(argv[1]), atof(argv[3])));
+	return 0;
+}
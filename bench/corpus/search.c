@@ -0,0 +1,25 @@
+#include "common.h"
+
+int binary_search(int *values, int n, int key) {
+	int low = 0, high = n - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (values[mid] == key) {
+			return mid;
+		} else if (values[mid] < key) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	int values[MAX_ITEMS];
+	int i;
+	for (i = 0; i < MAX_ITEMS; i++) {
+		values[i] = i * 2;
+	}
+	return binary_search(values, MAX_ITEMS, argc > 1 ? atoi(argv[1]) : 7) < 0 ? 1 : 0;
+}
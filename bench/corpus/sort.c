@@ -0,0 +1,26 @@
+#include "common.h"
+
+void bubble_sort(struct item *items, int n) {
+	int i, j;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j + 1 < n - i; j++) {
+			if (items[j].key > items[j + 1].key) {
+				struct item tmp = items[j];
+				items[j] = items[j + 1];
+				items[j + 1] = tmp;
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	struct item items[MAX_ITEMS];
+	int i, n = argc > 1 ? atoi(argv[1]) : 10;
+	if (n > MAX_ITEMS)
+		n = MAX_ITEMS;
+	for (i = 0; i < n; i++) {
+		items[i].key = rand() % 100;
+	}
+	bubble_sort(items, n);
+	return 0;
+}
@@ -0,0 +1,20 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+void to_upper(char *s) {
+	for (; *s; s++) {
+		if (islower(*s))
+			*s = toupper(*s);
+	}
+}
+
+int main(int argc, char **argv) {
+	char buffer[128];
+	if (argc < 2)
+		return 1;
+	strncpy(buffer, argv[1], sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+	to_upper(buffer);
+	printf("%s\n", buffer);
+	return 0;
+}
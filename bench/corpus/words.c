@@ -0,0 +1,24 @@
+#include "common.h"
+
+int count_words(const char *s) {
+	int words = 0, inWord = 0;
+	do {
+		if (isalpha(*s)) {
+			if (!inWord)
+				words++;
+			inWord = 1;
+		} else {
+			inWord = 0;
+		}
+	} while (*s++);
+	return words;
+}
+
+int main(int argc, char **argv) {
+	int i, total = 0;
+	for (i = 1; i < argc; i++) {
+		total += count_words(argv[i]);
+	}
+	printf("%d\n", total);
+	return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Times kcov on the corpus without PCH, then with precompiled preambles
+# from an empty cache (cold) and from the cache left by the cold run (warm).
+# Also checks that the instrumented files are the same in the three modes.
+# Fails as soon as kcov fails or reports a clang error.
+# Usage: bench/run.sh [path/to/kcov] [repetitions]
+
+KCOV=${1:-$(dirname "$0")/../kcov}
+RUNS=${2:-5}
+CORPUS=$(dirname "$0")/corpus
+WORK=$(mktemp -d)
+CACHE=$WORK/pch
+
+# The instrumented files are written next to the sources, in the tracked corpus.
+cleanup() {
+	rm -rf "$WORK" "$CORPUS"/*-cov.c
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+rm -f "$CORPUS"/*-cov.c
+FILES=$(ls "$CORPUS"/*.c)
+
+# run <label> [kcov options]: instruments the corpus, keeps the output in $WORK/<label>
+run() {
+	label=$1
+	shift
+	if ! "$KCOV" "$@" $FILES > /dev/null 2> "$WORK/$label.err" || grep -q "error:" "$WORK/$label.err"; then
+		echo "kcov failed ($label):" >&2
+		cat "$WORK/$label.err" >&2
+		exit 1
+	fi
+	cat "$CORPUS"/*-cov.c > "$WORK/$label"
+	rm -f "$CORPUS"/*-cov.c
+}
+
+TIMEFORMAT="%R s"
+for i in $(seq "$RUNS"); do
+	echo "run $i"
+	echo -n "  no PCH: "; time run nopch
+	rm -rf "$CACHE"
+	echo -n "  cold:   "; time run cold -pch-cache "$CACHE"
+	echo -n "  warm:   "; time run warm -pch-cache "$CACHE"
+	for label in cold warm; do
+		if ! cmp -s "$WORK/nopch" "$WORK/$label"; then
+			echo "instrumented files differ between no PCH and $label" >&2
+			exit 1
+		fi
+	done
+done
+echo "instrumented files identical in all modes"
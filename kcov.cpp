@@ -5,6 +5,12 @@
 #include <sstream>
 #include <map>
 #include <utility>
+#include <vector>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/ASTContext.h"
@@ -25,6 +31,12 @@
 #include "llvm/ADT/IntrusiveRefCntPtr.h"
 #include "clang/Lex/HeaderSearch.h"
 #include "clang/Frontend/Utils.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "clang/Serialization/ASTWriter.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 using namespace clang;
 using namespace std;
@@ -35,9 +47,6 @@ template<typename T> string int_to_string(T i) {
 	return convert.str();
 }
 
-// A Rewriter helps us manage the code rewriting task.
-Rewriter TheRewriter;
-
 class Branch {
 private:
     unsigned int lineNumber;
@@ -65,13 +74,15 @@ private:
     vector<SourceLocation> returnLocations;
     string radical;
     LangOptions lOpts;
+    // A Rewriter helps us manage the code rewriting task (one per instrumented file).
+    Rewriter& TheRewriter;
 
     SourceManager& getSrcMngr() {
         return context->getSourceManager();
     }
 
 public:
-	MyASTVisitor(CompilerInstance* CI) {
+	MyASTVisitor(CompilerInstance* CI, Rewriter& R) : TheRewriter(R) {
 		nbStmt = 0;
         context = &(CI->getASTContext());
         branches = vector<Branch>();
@@ -290,12 +301,18 @@ public:
 class MyASTConsumer : public ASTConsumer
 {
 public:
-    MyASTConsumer(CompilerInstance* CI) : Visitor(CI)
+    MyASTConsumer(CompilerInstance* CI, Rewriter& R) : SrcMgr(CI->getSourceManager()), Visitor(CI, R)
     {
     }
 
     virtual bool HandleTopLevelDecl(DeclGroupRef DR) {
         for (DeclGroupRef::iterator b = DR.begin(), e = DR.end(); b != e; ++b) {
+            // Only the main file gets instrumented: decls coming from headers
+            // (or deserialized from a precompiled preamble) are skipped so that
+            // branch numbering does not depend on how the headers were parsed.
+            if (SrcMgr.getFileID(SrcMgr.getExpansionLoc((*b)->getLocation())) != SrcMgr.getMainFileID()) {
+                continue;
+            }
             // Travel each function declaration using MyASTVisitor
             Visitor.TraverseDecl(*b);
         }
@@ -311,23 +328,40 @@ public:
     }
 
 private:
+    SourceManager& SrcMgr;
     MyASTVisitor Visitor;
 };
 
 
-int main(int argc, char *argv[])
-{
-    if (argc != 2) {
-        llvm::errs() << "Usage: kcov <filename>\n";
-        return 1;
-    }
+// A precompiled preamble: the PCH built from the leading directive block of a
+// file (its includes, defines, ...), and the number of bytes of the file it covers.
+// The preamble is compiled as a virtual header (Header, holding Text) that sits
+// next to the file, so that its quoted includes resolve from the same directory.
+struct Preamble {
+    string Header;
+    string Text;
+    string PCHFile;
+    unsigned int Bytes;
+    bool StartOfLine;
 
-	// CompilerInstance will hold the instance of the Clang compiler for us,
-	// managing the various objects needed to run the compiler.
-	CompilerInstance TheCompInst;
-    
+    Preamble() : Bytes(0), StartOfLine(false) {}
+};
+
+// Prepares a compiler instance for parsing C code: target, file/source managers,
+// preprocessor, AST context and header search paths.
+// The virtual preamble header, if any, is registered with the same contents
+// whether the PCH is being built or loaded.
+// If ThePreamble has a PCH, it is loaded into the AST context so that the
+// headers it covers are not parsed again.
+// If Quiet is set, diagnostics are dropped (used to probe the PCH cache).
+bool SetupCompilerInstance(CompilerInstance& TheCompInst, const Preamble& ThePreamble, bool Quiet = false)
+{
     // Diagnostics manage problems and issues in compile 
-    TheCompInst.createDiagnostics(NULL, false);
+    if (Quiet) {
+        TheCompInst.createDiagnostics(new IgnoringDiagConsumer(), true);
+    } else {
+        TheCompInst.createDiagnostics(NULL, false);
+    }
 
     // Set target platform options 
     // Initialize target info with the default triple for our platform.
@@ -342,7 +376,6 @@ int main(int argc, char *argv[])
     
     // SourceManager handles loading and caching of source files into memory.
     TheCompInst.createSourceManager(FileMgr);
-    SourceManager &SourceMgr = TheCompInst.getSourceManager();
     
     // Prreprocessor runs within a single source file
     TheCompInst.createPreprocessor();
@@ -352,11 +385,6 @@ int main(int argc, char *argv[])
 
     // Enable HeaderSearch option
     llvm::IntrusiveRefCntPtr<clang::HeaderSearchOptions> hso( new HeaderSearchOptions());
-    HeaderSearch headerSearch(hso,
-                              TheCompInst.getFileManager(),
-                              TheCompInst.getDiagnostics(),
-                              TheCompInst.getLangOpts(),
-                              TI);
 
     // <Warning!!> -- Platform Specific Code lives here
     // This depends on A) that you're running linux and
@@ -382,42 +410,319 @@ int main(int argc, char *argv[])
                     false);
     // </Warning!!> -- End of Platform Specific Code
 
+    // The preamble header only exists in memory. Clang records remapped files
+    // as overridden in the PCH, so the reader does not look for them on disk.
+    if (!ThePreamble.Header.empty()) {
+        TheCompInst.getPreprocessorOpts().addRemappedFile(ThePreamble.Header,
+                    llvm::MemoryBuffer::getMemBufferCopy(ThePreamble.Text, ThePreamble.Header));
+    }
+
+    // Behave as with -include-pch: the preamble header is implicitly included
+    // before the main file.
+    const string& PCHFile = ThePreamble.PCHFile;
+    if (!PCHFile.empty()) {
+        TheCompInst.getPreprocessorOpts().ImplicitPCHInclude = PCHFile;
+    }
+
     InitializePreprocessor(TheCompInst.getPreprocessor(), 
                   TheCompInst.getPreprocessorOpts(),
                   *hso,
                   TheCompInst.getFrontendOpts());
 
+    if (!PCHFile.empty()) {
+        // Decls and macros of the preamble are lazily deserialized from the PCH.
+        // The reader validates the PCH against the headers it was built from,
+        // the compiler version and the options.
+        TheCompInst.createPCHExternalASTSource(PCHFile, false, false, 0);
+        if (!TheCompInst.getModuleManager()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ReadFile(const string& FileName, string& Contents)
+{
+    ifstream input(FileName.c_str(), ios::in | ios::binary);
+    if (!input) {
+        return false;
+    }
+    ostringstream buffer;
+    buffer << input.rdbuf();
+    Contents = buffer.str();
+    return true;
+}
+
+// Name of a temporary file next to FileName, unique to this process, so that
+// concurrent runs never write to the same file.
+string TemporaryFileFor(const string& FileName)
+{
+    return FileName + ".tmp" + int_to_string<int>(getpid());
+}
+
+// Absolute path of the directory holding FileName.
+string DirectoryOf(const string& FileName)
+{
+    size_t slash = FileName.find_last_of('/');
+    string dir = slash == string::npos ? "." : (slash == 0 ? "/" : FileName.substr(0, slash));
+    char absolute[PATH_MAX];
+    if (!realpath(dir.c_str(), absolute)) {
+        return dir;
+    }
+    return absolute;
+}
+
+// 64-bit FNV-1a: stable across runs and platforms, unlike llvm::hash_value.
+string HashString(const string& s)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (unsigned int i = 0; i < s.size(); i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 1099511628211ULL;
+    }
+    ostringstream convert;
+    convert << hex << hash;
+    return convert.str();
+}
+
+// Returns true if the PCH exists and the ASTReader accepts it.
+bool CanLoadPCH(const Preamble& ThePreamble)
+{
+    struct stat pchStat;
+    if (stat(ThePreamble.PCHFile.c_str(), &pchStat) != 0) {
+        return false;
+    }
+    CompilerInstance TheCompInst;
+    return SetupCompilerInstance(TheCompInst, ThePreamble, true);
+}
+
+// Parses the preamble header and serializes the result as a precompiled preamble.
+// The PCH is written to a temporary file and only renamed to ThePreamble.PCHFile
+// once it has been parsed without errors.
+bool GeneratePCH(const Preamble& ThePreamble)
+{
+    const string& PCHFile = ThePreamble.PCHFile;
+    Preamble Source = ThePreamble;
+    Source.PCHFile = "";
+
+    CompilerInstance TheCompInst;
+    if (!SetupCompilerInstance(TheCompInst, Source)) {
+        return false;
+    }
+
+    const FileEntry *FileIn = TheCompInst.getFileManager().getFile(ThePreamble.Header);
+    if (!FileIn) {
+        llvm::errs() << "Cannot open preamble header " << ThePreamble.Header << "\n";
+        return false;
+    }
+    TheCompInst.getSourceManager().createMainFileID(FileIn);
+
+    string tmpName = TemporaryFileFor(PCHFile);
+    string ErrorInfo;
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR < 4
+    llvm::raw_fd_ostream PCHOut(tmpName.c_str(), ErrorInfo, llvm::raw_fd_ostream::F_Binary);
+#else
+    llvm::raw_fd_ostream PCHOut(tmpName.c_str(), ErrorInfo, llvm::sys::fs::F_Binary);
+#endif
+    if (!ErrorInfo.empty()) {
+        llvm::errs() << "Cannot write precompiled preamble " << tmpName << ": " << ErrorInfo << "\n";
+        return false;
+    }
+
+    TheCompInst.getDiagnosticClient().BeginSourceFile(TheCompInst.getLangOpts(),&TheCompInst.getPreprocessor());
+
+    llvm::outs() << "Building precompiled preamble " << PCHFile << "...\n";
 
+    // PCHGenerator writes the AST and the preprocessor state once the header is parsed.
+    PCHGenerator TheGenerator(TheCompInst.getPreprocessor(), PCHFile, 0, "", &PCHOut);
+    ParseAST(TheCompInst.getPreprocessor(), &TheGenerator, TheCompInst.getASTContext(), false, TU_Prefix);
+
+    PCHOut.close();
+    bool failed = PCHOut.has_error() || TheCompInst.getDiagnostics().hasErrorOccurred();
+    PCHOut.clear_error();
+    if (failed || rename(tmpName.c_str(), PCHFile.c_str()) != 0) {
+        llvm::errs() << "Cannot build precompiled preamble " << PCHFile << "\n";
+        remove(tmpName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Finds the preamble of FileName (the directives before its first declaration)
+// and returns the PCH standing for it, building it if needed.
+// Files of the same directory with the same preamble share one PCH, which stays
+// in CacheDir for later runs. The preamble header is virtual and placed in the
+// directory of FileName, spelled as in FileName, so that the PCH sees the same
+// headers as a plain parse of the file. A PCH that cannot be loaded (stale headers, other
+// compiler, interrupted build...) is rebuilt once; if that fails too, the file
+// is parsed without PCH.
+// Checked remembers the PCHs already probed during this run ("" if unusable).
+Preamble GetPreamble(const string& FileName, const string& CacheDir, map<string, string>& Checked)
+{
+    Preamble result;
+    string contents;
+    if (!ReadFile(FileName, contents)) {
+        return result;
+    }
+
+    LangOptions lOpts;
+    llvm::OwningPtr<llvm::MemoryBuffer> Buffer(llvm::MemoryBuffer::getMemBuffer(contents));
+    pair<unsigned, bool> bounds = Lexer::ComputePreamble(Buffer.get(), lOpts);
+    if (bounds.first == 0) {
+        return result;
+    }
+
+    // The PCH is keyed on the preamble text itself, so that a file only ever gets
+    // the headers and macros it would have seen on its own.
+    size_t slash = FileName.find_last_of('/');
+    string spelledDir = slash == string::npos ? "" : FileName.substr(0, slash + 1);
+    string text = contents.substr(0, bounds.first);
+    string hash = HashString(DirectoryOf(FileName) + "\n" + spelledDir + "\n" + text);
+
+    result.Header = spelledDir + ".kcov-preamble-" + hash + ".h";
+    result.Text = text;
+    result.PCHFile = CacheDir + "/kcov-preamble-" + hash + ".pch";
+
+    map<string, string>::iterator known = Checked.find(result.Header);
+    if (known != Checked.end()) {
+        result.PCHFile = known->second;
+    } else {
+        if (CanLoadPCH(result)) {
+            llvm::outs() << "Reusing precompiled preamble " << result.PCHFile << "...\n";
+        } else if (!GeneratePCH(result) || !CanLoadPCH(result)) {
+            llvm::errs() << "Precompiled preamble " << result.PCHFile << " unusable - parsing without it.\n";
+            result.PCHFile = "";
+        }
+        Checked[result.Header] = result.PCHFile;
+    }
+
+    if (result.PCHFile.empty()) {
+        return Preamble();
+    }
+    result.Bytes = bounds.first;
+    result.StartOfLine = bounds.second;
+    return result;
+}
+
+// Instruments a single C file, writing the result to <radical>-cov.c.
+// With a precompiled preamble, the preamble bytes of the file are skipped by
+// the lexer: their content comes from the PCH instead.
+bool InstrumentFile(const string& origFileName, const Preamble& ThePreamble)
+{
+	// CompilerInstance will hold the instance of the Clang compiler for us,
+	// managing the various objects needed to run the compiler.
+	CompilerInstance TheCompInst;
+    if (!SetupCompilerInstance(TheCompInst, ThePreamble)) {
+        llvm::errs() << "Cannot load precompiled preamble " << ThePreamble.PCHFile << " - parsing " << origFileName << " without it.\n";
+        return InstrumentFile(origFileName, Preamble());
+    }
+    FileManager &FileMgr = TheCompInst.getFileManager();
+    SourceManager &SourceMgr = TheCompInst.getSourceManager();
+
+    Rewriter TheRewriter;
     TheRewriter.setSourceMgr(SourceMgr, TheCompInst.getLangOpts());
 
-    string origFileName = argv[1];
     string radical = origFileName.substr(0, origFileName.find_last_of(".c") - 1);
     string newCFileName = radical + "-cov.c";
 
     // Set the main file handled by the source manager to the input file.
-    const FileEntry *FileIn = FileMgr.getFile(argv[1]);
+    const FileEntry *FileIn = FileMgr.getFile(origFileName);
+    if (!FileIn) {
+        llvm::errs() << "Cannot open " << origFileName << "\n";
+        return false;
+    }
     SourceMgr.createMainFileID(FileIn);
+
+    if (ThePreamble.Bytes > 0) {
+        TheCompInst.getPreprocessor().setSkipMainFilePreamble(ThePreamble.Bytes, ThePreamble.StartOfLine);
+    }
     
     // Inform Diagnostics that processing of a source file is beginning. 
     TheCompInst.getDiagnosticClient().BeginSourceFile(TheCompInst.getLangOpts(),&TheCompInst.getPreprocessor());
     
     // Create an AST consumer instance which is going to get called by ParseAST.
-    MyASTConsumer TheConsumer(&TheCompInst);
+    MyASTConsumer TheConsumer(&TheCompInst, TheRewriter);
     TheConsumer.setRadical(radical);
 
-    llvm::outs() << "Beginning parsing...\n";
+    llvm::outs() << "Beginning parsing of " << origFileName << "...\n";
 
     // Parse the file to AST, registering our consumer as the AST consumer.
     ParseAST(TheCompInst.getPreprocessor(), &TheConsumer, TheCompInst.getASTContext());
 
     TheConsumer.writeInit();
 
+    // The file is still rewritten, but a run with parse errors must not look successful.
+    bool parseFailed = TheCompInst.getDiagnostics().hasErrorOccurred();
+    if (parseFailed) {
+        llvm::errs() << "Errors while parsing " << origFileName << " - instrumentation may be incomplete.\n";
+    }
+
     const RewriteBuffer *RewriteBuf = TheRewriter.getRewriteBufferFor(SourceMgr.getMainFileID());
+    if (!RewriteBuf) {
+        llvm::errs() << "Nothing to instrument in " << origFileName << "\n";
+        return false;
+    }
     ofstream output(newCFileName.c_str());
     output << string(RewriteBuf->begin(), RewriteBuf->end());
     output.close();
 
+    return !parseFailed;
+}
+
+void PrintUsage()
+{
+    llvm::errs() << "Usage: kcov [-pch-cache <dir>] <filename> [<filename>...]\n";
+    llvm::errs() << "\t-pch-cache <dir>: precompile the preamble of each file (the #include/#define\n";
+    llvm::errs() << "\t\tblock before its first declaration) and keep the PCHs in <dir>.\n";
+    llvm::errs() << "\t\tFiles of the same directory with an identical preamble share a PCH, within\n";
+    llvm::errs() << "\t\ta run and across runs. The preamble is compiled as if it were in the file's\n";
+    llvm::errs() << "\t\tdirectory, so it finds the same headers as the file itself.\n";
+    llvm::errs() << "\t\tStale or broken PCHs are rebuilt, or ignored if they cannot be.\n";
+    llvm::errs() << "Exits with a non-zero status if a file cannot be parsed without errors.\n";
+}
+
+int main(int argc, char *argv[])
+{
+    string cacheDir;
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-pch-cache") {
+            if (i + 1 >= argc || !cacheDir.empty()) {
+                PrintUsage();
+                return 1;
+            }
+            cacheDir = argv[++i];
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    if (files.empty()) {
+        PrintUsage();
+        return 1;
+    }
+
+    if (!cacheDir.empty() && mkdir(cacheDir.c_str(), 0777) != 0 && errno != EEXIST) {
+        llvm::errs() << "Cannot create " << cacheDir << " - parsing without precompiled preambles.\n";
+        cacheDir = "";
+    }
+
+    map<string, string> checkedPCHs;
+    int status = 0;
+    for (unsigned int i = 0; i < files.size(); i++) {
+        Preamble ThePreamble;
+        if (!cacheDir.empty()) {
+            ThePreamble = GetPreamble(files[i], cacheDir, checkedPCHs);
+        }
+        if (!InstrumentFile(files[i], ThePreamble)) {
+            status = 1;
+        }
+    }
+
     llvm::outs() << "Done !\n";
 
-    return 0;
+    return status;
 }